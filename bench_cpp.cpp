@@ -0,0 +1,115 @@
+/*
+ * Compare the cost of running small C++ callables through
+ * lftpool::pool::post/submit, a std::function trampoline over
+ * tpool_add_work and std::async.
+*/
+#include <stdio.h>
+#include <unistd.h>
+#include <atomic>
+#include <chrono>
+#include <functional>
+#include <future>
+#include <thread>
+#include <vector>
+#include "tpool.hpp"
+
+#define WORK_NUM (1 << 15)
+#define ASYNC_WORK_NUM (1 << 11)
+
+static std::atomic<long> sum;
+
+typedef std::chrono::steady_clock bench_clock;
+
+static void wait_for(long expected)
+{
+    while (sum.load(std::memory_order_relaxed) < expected)
+        std::this_thread::yield();
+}
+
+static void report(const char *name, int num, bench_clock::time_point start)
+{
+    double us = std::chrono::duration<double, std::micro>(bench_clock::now() - start).count();
+
+    printf("%-24s %8d works %10.0fus %8.3fus/work\n", name, num, us, us / num);
+}
+
+static void bench_post_inline(lftpool::pool &pool)
+{
+    std::atomic<long> *s = &sum;
+    bench_clock::time_point start = bench_clock::now();
+    int i;
+
+    sum = 0;
+    for (i = 0; i < WORK_NUM; i++)
+        pool.post([s]() { s->fetch_add(1, std::memory_order_relaxed); });
+    wait_for(WORK_NUM);
+    report("post (inline)", WORK_NUM, start);
+}
+
+static void bench_submit(lftpool::pool &pool)
+{
+    std::vector<std::future<int>> results;
+    bench_clock::time_point start = bench_clock::now();
+    int i;
+
+    results.reserve(WORK_NUM);
+    for (i = 0; i < WORK_NUM; i++)
+        results.push_back(pool.submit([](int v) { return v + 1; }, i));
+    for (i = 0; i < WORK_NUM; i++)
+        sum += results[i].get();
+    report("submit (future)", WORK_NUM, start);
+}
+
+static void std_function_trampoline(void *arg)
+{
+    std::function<void()> *fn = static_cast<std::function<void()> *>(arg);
+
+    (*fn)();
+    delete fn;
+}
+
+static void bench_std_function(lftpool::pool &pool)
+{
+    void *tpool = pool.native_handle();
+    std::atomic<long> *s = &sum;
+    bench_clock::time_point start = bench_clock::now();
+    int i;
+
+    sum = 0;
+    for (i = 0; i < WORK_NUM; i++) {
+        std::function<void()> *fn = new std::function<void()>(
+            [s]() { s->fetch_add(1, std::memory_order_relaxed); });
+
+        if (tpool_add_work(tpool, std_function_trampoline, fn) < 0)
+            delete fn;
+    }
+    wait_for(WORK_NUM);
+    report("std::function baseline", WORK_NUM, start);
+}
+
+static void bench_std_async(void)
+{
+    bench_clock::time_point start = bench_clock::now();
+    std::vector<std::future<int>> results;
+    int i;
+
+    results.reserve(ASYNC_WORK_NUM);
+    for (i = 0; i < ASYNC_WORK_NUM; i++)
+        results.push_back(std::async(std::launch::async, [](int v) { return v + 1; }, i));
+    for (i = 0; i < ASYNC_WORK_NUM; i++)
+        sum += results[i].get();
+    report("std::async", ASYNC_WORK_NUM, start);
+}
+
+int main()
+{
+    int cpu_num = sysconf(_SC_NPROCESSORS_CONF);
+    /* the pool is shared so that tpool_init is not timed */
+    lftpool::pool pool(cpu_num);
+
+    bench_post_inline(pool);
+    bench_submit(pool);
+    bench_std_function(pool);
+    bench_std_async();
+    return 0;
+}
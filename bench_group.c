@@ -0,0 +1,127 @@
+/*
+ * Latency of a light tenant while a heavy tenant adds a burst of works:
+ * both with tpool_add_work compared with one group per tenant.
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sched.h>
+#include <time.h>
+#include "tpool.h"
+
+#define HEAVY_NUM       20000
+#define LIGHT_NUM       200
+#define LIGHT_PERIOD_NS 1000000L
+
+struct light_work {
+    struct timespec added;
+    long            latency_ns;
+};
+
+static volatile int num_works_done;
+static struct light_work light_works[LIGHT_NUM];
+
+static long diff_ns(struct timespec *from, struct timespec *to)
+{
+    return (to->tv_sec - from->tv_sec) * 1000000000L + to->tv_nsec - from->tv_nsec;
+}
+
+static void heavy_work(void *args)
+{
+    struct timespec start, now;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    do {
+        clock_gettime(CLOCK_MONOTONIC, &now);
+    } while (diff_ns(&start, &now) < 20000);
+    __sync_fetch_and_add(&num_works_done, 1);
+}
+
+static void light_work(void *args)
+{
+    struct light_work *work = args;
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    work->latency_ns = diff_ns(&work->added, &now);
+    __sync_fetch_and_add(&num_works_done, 1);
+}
+
+/* nanosleep is cut short by SIGUSR1 of worker threads */
+static void sleep_until(struct timespec *deadline)
+{
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, deadline, NULL) != 0)
+        ;
+}
+
+static int cmp_long(const void *a, const void *b)
+{
+    long x = *(const long *)a, y = *(const long *)b;
+
+    return x < y ? -1 : x > y;
+}
+
+static void report(const char *name)
+{
+    long latency[LIGHT_NUM];
+    int i;
+
+    for (i = 0; i < LIGHT_NUM; i++)
+        latency[i] = light_works[i].latency_ns;
+    qsort(latency, LIGHT_NUM, sizeof(latency[0]), cmp_long);
+    printf("%-8s light tenant latency p50 %8ldus  p99 %8ldus  max %8ldus\n", name,
+           latency[LIGHT_NUM / 2] / 1000, latency[LIGHT_NUM * 99 / 100] / 1000,
+           latency[LIGHT_NUM - 1] / 1000);
+}
+
+static void bench(void *tpool, void *heavy, void *light)
+{
+    struct timespec deadline;
+    int i;
+
+    num_works_done = 0;
+    for (i = 0; i < HEAVY_NUM; i++) {
+        if (heavy)
+            tpool_group_add_work(heavy, heavy_work, NULL);
+        else
+            tpool_add_work(tpool, heavy_work, NULL);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &deadline);
+    for (i = 0; i < LIGHT_NUM; i++) {
+        clock_gettime(CLOCK_MONOTONIC, &light_works[i].added);
+        if (light)
+            tpool_group_add_work(light, light_work, &light_works[i]);
+        else
+            tpool_add_work(tpool, light_work, &light_works[i]);
+        deadline.tv_nsec += LIGHT_PERIOD_NS;
+        if (deadline.tv_nsec >= 1000000000L) {
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000L;
+        }
+        sleep_until(&deadline);
+    }
+    while (num_works_done < HEAVY_NUM + LIGHT_NUM)
+        sched_yield();
+}
+
+int main()
+{
+    int cpu_num = sysconf(_SC_NPROCESSORS_CONF);
+    void *tpool = tpool_init(cpu_num);
+    void *heavy, *light;
+
+    if (tpool == NULL)
+        return 1;
+    printf("%d heavy works of 20us, %d light works every %ldus, %d threads\n",
+           HEAVY_NUM, LIGHT_NUM, LIGHT_PERIOD_NS / 1000, cpu_num);
+    bench(tpool, NULL, NULL);
+    report("shared");
+    heavy = tpool_group_create(tpool, 1, 0);
+    light = tpool_group_create(tpool, 1, 0);
+    if (heavy == NULL || light == NULL)
+        return 1;
+    bench(tpool, heavy, light);
+    report("groups");
+    tpool_destroy(tpool, 1);
+    return 0;
+}
@@ -0,0 +1,142 @@
+/*
+ * Several processes running works: each with a pool of its own compared
+ * with all of them adding works to one shared memory pool.
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sched.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include "tpool.h"
+
+#define PROCESS_NUM 4
+#define WORK_NUM    10000
+#define WORK_NS     5000L
+
+static volatile int num_works_done;
+
+/* shared with child processes, so that tpool_init is not timed */
+static struct {
+    int num_ready;
+    int go;
+} *barrier;
+
+static long diff_ns(struct timespec *from, struct timespec *to)
+{
+    return (to->tv_sec - from->tv_sec) * 1000000000L + to->tv_nsec - from->tv_nsec;
+}
+
+static void spin_work(void)
+{
+    struct timespec start, now;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    do {
+        clock_gettime(CLOCK_MONOTONIC, &now);
+    } while (diff_ns(&start, &now) < WORK_NS);
+    __sync_fetch_and_add(&num_works_done, 1);
+}
+
+static void local_work(void *args)
+{
+    spin_work();
+}
+
+static void shm_work(void *payload, unsigned int len)
+{
+    spin_work();
+}
+
+static void local_process(int cpu_num)
+{
+    void *tpool = tpool_init(cpu_num);
+    int i;
+
+    if (tpool == NULL)
+        _exit(1);
+    __sync_fetch_and_add(&barrier->num_ready, 1);
+    while (!__atomic_load_n(&barrier->go, __ATOMIC_ACQUIRE))
+        sched_yield();
+    for (i = 0; i < WORK_NUM; i++)
+        while (tpool_add_work(tpool, local_work, NULL) < 0)
+            sched_yield();
+    tpool_destroy(tpool, 1);
+    _exit(0);
+}
+
+static void shm_process(const char *name)
+{
+    void *client = tpool_shm_attach(name);
+    int i;
+
+    if (client == NULL)
+        _exit(1);
+    for (i = 0; i < WORK_NUM; i++)
+        while (tpool_shm_add_work(client, 0, &i, sizeof(i)) < 0)
+            sched_yield();
+    tpool_shm_detach(client);
+    _exit(0);
+}
+
+static void wait_processes(void)
+{
+    int status;
+
+    while (wait(&status) > 0) {
+        if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+            printf("process failed\n");
+            exit(1);
+        }
+    }
+}
+
+int main()
+{
+    int cpu_num = sysconf(_SC_NPROCESSORS_CONF);
+    tpool_shm_func funcs[] = {shm_work};
+    struct timespec tstart, tend;
+    char name[64];
+    void *tpool;
+    int i;
+
+    printf("%d processes adding %d works of %ldus, %d cpus\n",
+           PROCESS_NUM, WORK_NUM, WORK_NS / 1000, cpu_num);
+    fflush(stdout);
+
+    barrier = mmap(NULL, sizeof(*barrier), PROT_READ | PROT_WRITE,
+                 MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (barrier == MAP_FAILED)
+        return 1;
+    barrier->num_ready = barrier->go = 0;
+    for (i = 0; i < PROCESS_NUM; i++)
+        if (fork() == 0)
+            local_process(cpu_num);
+    while (__atomic_load_n(&barrier->num_ready, __ATOMIC_ACQUIRE) < PROCESS_NUM)
+        usleep(1000);
+    clock_gettime(CLOCK_MONOTONIC, &tstart);
+    __atomic_store_n(&barrier->go, 1, __ATOMIC_RELEASE);
+    wait_processes();
+    clock_gettime(CLOCK_MONOTONIC, &tend);
+    printf("pool per process: %8ldus (%d threads)\n",
+           diff_ns(&tstart, &tend) / 1000, PROCESS_NUM * cpu_num);
+    fflush(stdout);
+
+    snprintf(name, sizeof(name), "/lftpool-bench-%d", (int)getpid());
+    tpool = tpool_shm_create(name, cpu_num, funcs, 1);
+    if (tpool == NULL)
+        return 1;
+    clock_gettime(CLOCK_MONOTONIC, &tstart);
+    for (i = 0; i < PROCESS_NUM; i++)
+        if (fork() == 0)
+            shm_process(name);
+    wait_processes();
+    while (num_works_done < PROCESS_NUM * WORK_NUM)
+        sched_yield();
+    clock_gettime(CLOCK_MONOTONIC, &tend);
+    printf("shared pool:      %8ldus (%d threads)\n",
+           diff_ns(&tstart, &tend) / 1000, cpu_num);
+    tpool_shm_destroy(tpool, 1);
+    return 0;
+}
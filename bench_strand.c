@@ -0,0 +1,118 @@
+/*
+ * Works updating per-key state: a mutex per key with tpool_add_work
+ * compared with tpool_add_work_keyed, which needs no lock.
+*/
+#include <stdio.h>
+#include <unistd.h>
+#include <sched.h>
+#include <pthread.h>
+#include <sys/time.h>
+#include "tpool.h"
+
+#define WORK_NUM  (1 << 15)
+#define STATE_LEN 64
+
+struct key_state {
+    pthread_mutex_t lock;
+    unsigned long   data[STATE_LEN];
+};
+
+struct key_work {
+    struct key_state *state;
+    unsigned long     val;
+};
+
+static volatile int num_works_done;
+
+static void update_state(struct key_state *state, unsigned long val)
+{
+    int i;
+
+    for (i = 0; i < STATE_LEN; i++)
+        state->data[i] += val * i;
+}
+
+static void mutex_work(void *args)
+{
+    struct key_work *work = args;
+
+    pthread_mutex_lock(&work->state->lock);
+    update_state(work->state, work->val);
+    pthread_mutex_unlock(&work->state->lock);
+    __sync_fetch_and_add(&num_works_done, 1);
+}
+
+static void strand_work(void *args)
+{
+    struct key_work *work = args;
+
+    update_state(work->state, work->val);
+    __sync_fetch_and_add(&num_works_done, 1);
+}
+
+static void wait_works_done(void)
+{
+    while (num_works_done < WORK_NUM)
+        sched_yield();
+}
+
+static unsigned long elapsed_us(struct timeval *tstart)
+{
+    struct timeval tend;
+
+    gettimeofday(&tend, NULL);
+    return 1000000 * (tend.tv_sec - tstart->tv_sec) +
+           tend.tv_usec - tstart->tv_usec;
+}
+
+static struct key_state states[64];
+static struct key_work works[WORK_NUM];
+
+static void bench(void *tpool, int num_keys)
+{
+    struct timeval tstart;
+    unsigned long mutex_us, strand_us;
+    int i;
+
+    for (i = 0; i < num_keys; i++)
+        pthread_mutex_init(&states[i].lock, NULL);
+    for (i = 0; i < WORK_NUM; i++) {
+        works[i].state = &states[i % num_keys];
+        works[i].val = i;
+    }
+
+    num_works_done = 0;
+    gettimeofday(&tstart, NULL);
+    for (i = 0; i < WORK_NUM; i++)
+        while (tpool_add_work(tpool, mutex_work, &works[i]) < 0)
+            sched_yield();
+    wait_works_done();
+    mutex_us = elapsed_us(&tstart);
+
+    num_works_done = 0;
+    gettimeofday(&tstart, NULL);
+    for (i = 0; i < WORK_NUM; i++)
+        while (tpool_add_work_keyed(tpool, i % num_keys, strand_work, &works[i]) < 0)
+            sched_yield();
+    wait_works_done();
+    strand_us = elapsed_us(&tstart);
+
+    printf("%2d keys: mutex %8luus  strand %8luus\n", num_keys, mutex_us, strand_us);
+    for (i = 0; i < num_keys; i++)
+        pthread_mutex_destroy(&states[i].lock);
+}
+
+int main()
+{
+    int cpu_num = sysconf(_SC_NPROCESSORS_CONF);
+    void *tpool = tpool_init(cpu_num);
+    int num_keys;
+
+    if (tpool == NULL)
+        return 1;
+    printf("%d works on %d threads\n", WORK_NUM, cpu_num);
+    for (num_keys = 1; num_keys <= 64; num_keys <<= 1)
+        bench(tpool, num_keys);
+    tpool_destroy(tpool, 1);
+    return 0;
+}
@@ -1,5 +1,9 @@
 #include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
 #include <unistd.h>
+#include <sched.h>
+#include <sys/wait.h>
 #include <sys/time.h>
 #include "tpool.h"
 
@@ -163,6 +167,399 @@ enum test_return test_least_load(void)
     return TEST_PASS;
 }
 
+#define KEY_NUM 8
+
+struct ordered_state {
+    int running;
+    int next_seq;
+    int broken;
+};
+
+struct ordered_work {
+    struct ordered_state *state;
+    int seq;
+};
+
+static void ordered_work(void *args)
+{
+    struct ordered_work *work = args;
+    struct ordered_state *state = work->state;
+
+    if (__sync_fetch_and_add(&state->running, 1) != 0)
+        state->broken = 1;
+    if (state->next_seq++ != work->seq)
+        state->broken = 1;
+    light_work(NULL);
+    __sync_fetch_and_sub(&state->running, 1);
+}
+
+static enum test_return test_strand(void)
+{
+    void *tpool = tpool_init(4);
+    void *strand;
+    static struct ordered_work works[WORK_NUM << 4];
+    struct ordered_state state = {0, 0, 0};
+    int i;
+
+    if (tpool == NULL)
+        return TEST_FAIL;
+    strand = tpool_strand_create(tpool);
+    if (strand == NULL) {
+        tpool_destroy(tpool, 0);
+        return TEST_FAIL;
+    }
+    for(i = 0; i < WORK_NUM << 4; i++) {
+        works[i].state = &state;
+        works[i].seq = i;
+        if (tpool_strand_add_work(strand, ordered_work, &works[i]) < 0) {
+            tpool_destroy(tpool, 0);
+            return TEST_FAIL;
+        }
+    }
+    tpool_destroy(tpool, 1);
+    if (state.broken || state.next_seq != WORK_NUM << 4)
+        return TEST_FAIL;
+    return TEST_PASS;
+}
+
+static volatile int gate_open, num_strand_works_done, num_done_at_mark;
+
+static void gate_work(void *args)
+{
+    while (!gate_open)
+        sched_yield();
+}
+
+static void strand_count_work(void *args)
+{
+    num_strand_works_done++;
+}
+
+static void mark_work(void *args)
+{
+    num_done_at_mark = num_strand_works_done;
+}
+
+static enum test_return test_strand_batch(void)
+{
+    void *tpool = tpool_init(1);
+    void *strand;
+    int i;
+
+    if (tpool == NULL)
+        return TEST_FAIL;
+    strand = tpool_strand_create(tpool);
+    gate_open = num_strand_works_done = 0;
+    num_done_at_mark = -1;
+    /* keep the only thread busy until the strand and mark_work are queued behind it */
+    if (strand == NULL || tpool_add_work(tpool, gate_work, NULL) < 0) {
+        tpool_destroy(tpool, 0);
+        return TEST_FAIL;
+    }
+    for(i = 0; i < WORK_NUM << 4; i++) {
+        if (tpool_strand_add_work(strand, strand_count_work, NULL) < 0) {
+            gate_open = 1;
+            tpool_destroy(tpool, 0);
+            return TEST_FAIL;
+        }
+    }
+    if (tpool_add_work(tpool, mark_work, NULL) < 0) {
+        gate_open = 1;
+        tpool_destroy(tpool, 0);
+        return TEST_FAIL;
+    }
+    gate_open = 1;
+    tpool_destroy(tpool, 1);
+    if (num_strand_works_done != WORK_NUM << 4 ||
+            num_done_at_mark < 0 || num_done_at_mark >= WORK_NUM << 4)
+        return TEST_FAIL;
+    return TEST_PASS;
+}
+
+#define SLOW_STRAND_WORK_NUM 200
+
+static void slow_strand_work(void *args)
+{
+    usleep(200);
+    num_strand_works_done++;
+}
+
+static enum test_return test_strand_destroy(void)
+{
+    void *tpool = tpool_init(1);
+    void *strand;
+    int i;
+
+    if (tpool == NULL)
+        return TEST_FAIL;
+    strand = tpool_strand_create(tpool);
+    if (strand == NULL) {
+        tpool_destroy(tpool, 0);
+        return TEST_FAIL;
+    }
+    num_strand_works_done = 0;
+    /* more than one batch, so the strand is deferred while destroy waits */
+    for(i = 0; i < SLOW_STRAND_WORK_NUM; i++) {
+        if (tpool_strand_add_work(strand, slow_strand_work, NULL) < 0) {
+            tpool_destroy(tpool, 0);
+            return TEST_FAIL;
+        }
+    }
+    tpool_destroy(tpool, 1);
+    if (num_strand_works_done != SLOW_STRAND_WORK_NUM)
+        return TEST_FAIL;
+    return TEST_PASS;
+}
+
+static enum test_return test_keyed_work(void)
+{
+    void *tpool = tpool_init(4);
+    static struct ordered_work works[KEY_NUM][WORK_NUM];
+    struct ordered_state states[KEY_NUM];
+    int i, key;
+
+    if (tpool == NULL)
+        return TEST_FAIL;
+    memset(states, 0, sizeof(states));
+    for(i = 0; i < WORK_NUM; i++) {
+        for (key = 0; key < KEY_NUM; key++) {
+            works[key][i].state = &states[key];
+            works[key][i].seq = i;
+            if (tpool_add_work_keyed(tpool, key, ordered_work, &works[key][i]) < 0) {
+                tpool_destroy(tpool, 0);
+                return TEST_FAIL;
+            }
+        }
+    }
+    tpool_destroy(tpool, 1);
+    for (key = 0; key < KEY_NUM; key++)
+        if (states[key].broken || states[key].next_seq != WORK_NUM)
+            return TEST_FAIL;
+    return TEST_PASS;
+}
+
+static volatile int num_works_done;
+
+static void count_work(void *args)
+{
+    light_work(NULL);
+    __sync_fetch_and_add(&num_works_done, 1);
+}
+
+static enum test_return test_group(void)
+{
+    void *tpool = tpool_init(4);
+    void *heavy, *light;
+    int i;
+
+    if (tpool == NULL)
+        return TEST_FAIL;
+    heavy = tpool_group_create(tpool, 3, 0);
+    light = tpool_group_create(tpool, 1, 0);
+    if (heavy == NULL || light == NULL) {
+        tpool_destroy(tpool, 0);
+        return TEST_FAIL;
+    }
+    num_works_done = 0;
+    for(i = 0; i < WORK_NUM << 4; i++) {
+        if (tpool_group_add_work(heavy, count_work, NULL) < 0 ||
+                (i % 4 == 0 && tpool_group_add_work(light, count_work, NULL) < 0) ||
+                tpool_add_work(tpool, count_work, NULL) < 0) {
+            tpool_destroy(tpool, 0);
+            return TEST_FAIL;
+        }
+    }
+    tpool_destroy(tpool, 1);
+    if (num_works_done != (WORK_NUM << 5) + (WORK_NUM << 2))
+        return TEST_FAIL;
+    return TEST_PASS;
+}
+
+#define GROUP_WORK_NUM 40
+
+static volatile int num_finished;
+static void *finish_order[2 * GROUP_WORK_NUM];
+
+static void ordered_group_work(void *args)
+{
+    finish_order[num_finished++] = args;
+}
+
+static enum test_return test_group_weight(void)
+{
+    void *tpool = tpool_init(1);
+    void *heavy, *light;
+    int i, num_light = 0;
+
+    if (tpool == NULL)
+        return TEST_FAIL;
+    heavy = tpool_group_create(tpool, 3, 0);
+    light = tpool_group_create(tpool, 1, 0);
+    gate_open = num_finished = 0;
+    /* both groups are backlogged before the only thread takes any of them */
+    if (heavy == NULL || light == NULL || tpool_add_work(tpool, gate_work, NULL) < 0) {
+        tpool_destroy(tpool, 0);
+        return TEST_FAIL;
+    }
+    for(i = 0; i < GROUP_WORK_NUM; i++) {
+        if (tpool_group_add_work(heavy, ordered_group_work, heavy) < 0 ||
+                tpool_group_add_work(light, ordered_group_work, light) < 0) {
+            gate_open = 1;
+            tpool_destroy(tpool, 0);
+            return TEST_FAIL;
+        }
+    }
+    gate_open = 1;
+    tpool_destroy(tpool, 1);
+    if (num_finished != 2 * GROUP_WORK_NUM)
+        return TEST_FAIL;
+    /* one light work in every four while both groups are busy */
+    for (i = 0; i < GROUP_WORK_NUM; i++)
+        num_light += finish_order[i] == light;
+    if (num_light != GROUP_WORK_NUM / 4)
+        return TEST_FAIL;
+    return TEST_PASS;
+}
+
+static int running, max_running;
+
+static void capped_work(void *args)
+{
+    int cur = __sync_add_and_fetch(&running, 1), max;
+
+    do {
+        max = max_running;
+    } while (cur > max && !__sync_bool_compare_and_swap(&max_running, max, cur));
+    heavy_work(NULL);
+    __sync_fetch_and_sub(&running, 1);
+}
+
+static enum test_return test_group_max_running(void)
+{
+    void *tpool = tpool_init(4);
+    void *group;
+    int i;
+
+    if (tpool == NULL)
+        return TEST_FAIL;
+    group = tpool_group_create(tpool, 1, 2);
+    if (group == NULL) {
+        tpool_destroy(tpool, 0);
+        return TEST_FAIL;
+    }
+    running = max_running = 0;
+    for(i = 0; i < WORK_NUM; i++) {
+        if (tpool_group_add_work(group, capped_work, NULL) < 0) {
+            tpool_destroy(tpool, 0);
+            return TEST_FAIL;
+        }
+    }
+    tpool_destroy(tpool, 1);
+    if (max_running > 2)
+        return TEST_FAIL;
+    return TEST_PASS;
+}
+
+#define CLIENT_NUM 4
+#define SHM_MAGIC_VAL 42
+
+static void shm_work(void *payload, unsigned int len)
+{
+    if (len == sizeof(int) && *(int *)payload == SHM_MAGIC_VAL)
+        __sync_fetch_and_add(&num_works_done, 1);
+}
+
+static void shm_client(const char *name, int detach)
+{
+    void *client = tpool_shm_attach(name);
+    int i, val = SHM_MAGIC_VAL;
+
+    if (client == NULL)
+        _exit(1);
+    for(i = 0; i < WORK_NUM; i++) {
+        if (tpool_shm_add_work(client, 0, &val, sizeof(val)) < 0)
+            _exit(1);
+    }
+    if (detach)
+        tpool_shm_detach(client);
+    _exit(0);
+}
+
+static enum test_return test_shm(void)
+{
+    tpool_shm_func funcs[] = {shm_work};
+    char name[64];
+    void *tpool;
+    int i, status, ret = TEST_PASS;
+    pid_t pid;
+
+    snprintf(name, sizeof(name), "/lftpool-test-%d", (int)getpid());
+    tpool = tpool_shm_create(name, 4, funcs, 1);
+    if (tpool == NULL)
+        return TEST_FAIL;
+    num_works_done = 0;
+    for (i = 0; i < CLIENT_NUM; i++) {
+        pid = fork();
+        if (pid < 0) {
+            ret = TEST_FAIL;
+            break;
+        }
+        /* the last client exits without detaching */
+        if (pid == 0)
+            shm_client(name, i < CLIENT_NUM - 1);
+    }
+    while (wait(&status) > 0) {
+        if (!WIFEXITED(status) || WEXITSTATUS(status) != 0)
+            ret = TEST_FAIL;
+    }
+    tpool_shm_destroy(tpool, 1);
+    if (num_works_done != CLIENT_NUM * WORK_NUM)
+        return TEST_FAIL;
+    return ret;
+}
+
+static void shm_crashing_client(const char *name)
+{
+    void *client = tpool_shm_attach(name);
+
+    if (client == NULL)
+        _exit(1);
+    /* crash while copying the payload, after a slot has been claimed */
+    tpool_shm_add_work(client, 0, (void *)8, sizeof(int));
+    _exit(0);
+}
+
+static enum test_return test_shm_client_crash(void)
+{
+    tpool_shm_func funcs[] = {shm_work};
+    char name[64];
+    void *tpool;
+    int status, ret = TEST_PASS;
+    pid_t pid;
+
+    snprintf(name, sizeof(name), "/lftpool-test-%d", (int)getpid());
+    tpool = tpool_shm_create(name, 2, funcs, 1);
+    if (tpool == NULL)
+        return TEST_FAIL;
+    num_works_done = 0;
+    pid = fork();
+    if (pid == 0)
+        shm_crashing_client(name);
+    if (pid < 0 || waitpid(pid, &status, 0) < 0 || !WIFSIGNALED(status))
+        ret = TEST_FAIL;
+    /* works behind the slot of the dead client must still run */
+    pid = fork();
+    if (pid == 0)
+        shm_client(name, 1);
+    if (pid < 0 || waitpid(pid, &status, 0) < 0 ||
+            !WIFEXITED(status) || WEXITSTATUS(status) != 0)
+        ret = TEST_FAIL;
+    tpool_shm_destroy(tpool, 1);
+    if (num_works_done != WORK_NUM)
+        return TEST_FAIL;
+    return ret;
+}
+
 typedef enum test_return (*TEST_FUNC)(void);
 
 struct testcase {
@@ -178,6 +575,15 @@ struct testcase testcases[] = {
     {"increase thread num", test_inc_thread},
     {"decrease thread num", test_dec_thread},
     {"set least load alogrithm", test_least_load},
+    {"works of a strand run in order", test_strand},
+    {"works with the same key run in order", test_keyed_work},
+    {"busy strand does not hold up other works", test_strand_batch},
+    {"destroy completes remaining strand works", test_strand_destroy},
+    {"works of weighted groups", test_group},
+    {"weights of groups share the thread", test_group_weight},
+    {"max running works of a group", test_group_max_running},
+    {"works added by other processes", test_shm},
+    {"work claimed by a crashed client is dropped", test_shm_client_crash},
     { NULL, NULL }
 };
 
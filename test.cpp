@@ -0,0 +1,138 @@
+#include <stdio.h>
+#include <sys/time.h>
+#include <atomic>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <vector>
+#include "tpool.hpp"
+
+enum test_return { TEST_PASS, TEST_FAIL };
+#define WORK_NUM 50
+
+static enum test_return test_submit_result(void)
+{
+    lftpool::pool pool(4);
+    std::vector<std::future<int>> results;
+    int i;
+
+    for (i = 0; i < WORK_NUM; i++)
+        results.push_back(pool.submit([](int a, int b) { return a * b; }, i, 2));
+    for (i = 0; i < WORK_NUM; i++)
+        if (results[i].get() != i * 2)
+            return TEST_FAIL;
+    return TEST_PASS;
+}
+
+static enum test_return test_move_only(void)
+{
+    lftpool::pool pool(2);
+    std::unique_ptr<std::string> str(new std::string("lftpool"));
+    auto fut = pool.submit([s = std::move(str)]() { return s->size(); });
+
+    return fut.get() == 7 ? TEST_PASS : TEST_FAIL;
+}
+
+static enum test_return test_exception(void)
+{
+    lftpool::pool pool(2);
+    auto fut = pool.submit([]() -> int { throw std::logic_error("work failed"); });
+
+    try {
+        fut.get();
+    } catch (const std::logic_error &) {
+        return TEST_PASS;
+    }
+    return TEST_FAIL;
+}
+
+static std::atomic<int> num_works_done;
+
+static enum test_return test_post_inline(void)
+{
+    std::atomic<int> *done = &num_works_done;
+    auto work = [done]() { done->fetch_add(1); };
+    int i;
+
+    static_assert(lftpool::fits_inline<decltype(work)>, "work should fit inline");
+    num_works_done = 0;
+    {
+        lftpool::pool pool(4);
+
+        for (i = 0; i < WORK_NUM; i++)
+            pool.post(work);
+    }
+    return num_works_done == WORK_NUM ? TEST_PASS : TEST_FAIL;
+}
+
+static enum test_return test_post_heap(void)
+{
+    std::string tag(64, 'x');
+    int i;
+
+    num_works_done = 0;
+    {
+        lftpool::pool pool(4);
+
+        for (i = 0; i < WORK_NUM; i++)
+            pool.post([tag]() { num_works_done += tag.size() == 64; });
+    }
+    return num_works_done == WORK_NUM ? TEST_PASS : TEST_FAIL;
+}
+
+static enum test_return test_post_exception(void)
+{
+    std::string tag(64, 'x');
+
+    num_works_done = 0;
+    {
+        lftpool::pool pool(1);
+
+        pool.post([]() { throw std::runtime_error("inline"); });
+        pool.post([tag]() { throw std::runtime_error(tag); });
+        pool.post([]() { num_works_done++; });
+    }
+    return num_works_done == 1 ? TEST_PASS : TEST_FAIL;
+}
+
+typedef enum test_return (*TEST_FUNC)(void);
+
+struct testcase {
+    const char *description;
+    TEST_FUNC function;
+};
+
+struct testcase testcases[] = {
+    {"submit and get result", test_submit_result},
+    {"move-only callable", test_move_only},
+    {"exception through future", test_exception},
+    {"post inline callable", test_post_inline},
+    {"post heap callable", test_post_heap},
+    {"exception of posted callable is dropped", test_post_exception},
+    { NULL, NULL }
+};
+
+int main()
+{
+    int exitcode = 0;
+    int i = 0;
+    struct timeval tstart,tend;
+    enum test_return ret;
+    unsigned long timeuse;
+
+    for (i = 0; testcases[i].description != NULL; ++i) {
+        gettimeofday(&tstart,NULL);
+        ret = testcases[i].function();
+        gettimeofday(&tend,NULL);
+        timeuse = 1000000 * (tend.tv_sec - tstart.tv_sec) +
+                  tend.tv_usec - tstart.tv_usec;
+        if (ret == TEST_PASS) {
+            printf("ok %d - %s    time: %luus\n", i + 1, testcases[i].description, timeuse);
+        } else {
+            printf("not ok %d - %s\n", i + 1, testcases[i].description);
+            exitcode = 1;
+        }
+    }
+
+    return exitcode;
+}
@@ -21,24 +21,7 @@
 #include <signal.h>
 #include <assert.h>
 #include "tpool.h"
-
-enum {
-    TPOOL_ERROR,
-    TPOOL_WARNING,
-    TPOOL_INFO,
-    TPOOL_DEBUG
-};
-
-#define debug(level, ...) do { \
-    if (level < TPOOL_DEBUG) {\
-        flockfile(stdout); \
-        printf("###%p.%s: ", (void *)pthread_self(), __func__); \
-        printf(__VA_ARGS__); \
-        putchar('\n'); \
-        fflush(stdout); \
-        funlockfile(stdout);\
-    }\
-} while (0)
+#include "tpool_debug.h"
 
 #define WORK_QUEUE_POWER 16
 #define WORK_QUEUE_SIZE (1 << WORK_QUEUE_POWER)
@@ -58,6 +41,14 @@ enum {
 /* enough large for any system */
 #define MAX_THREAD_NUM  512
 
+/* keys of tpool_add_work_keyed are hashed to so many strands */
+#define KEY_STRAND_POWER 10
+#define KEY_STRAND_NUM   (1 << KEY_STRAND_POWER)
+/* most works of a strand run before other works get the thread */
+#define STRAND_BATCH     64
+
+#define MAX_GROUP_NUM   64
+
 typedef struct tpool_work {
     void               (*routine)(void *);
     void                *arg;
@@ -67,6 +58,11 @@ typedef struct tpool_work {
 typedef struct {
     pthread_t    id;
     int          shutdown;
+    int          sleeping;  /* set while waiting for work, see group_wake_thread */
+    struct tpool *tpool;
+    /* strands which used up their batch, only touched by this thread */
+    struct tpool_strand *deferred_head;
+    struct tpool_strand *deferred_tail;
 #ifdef DEBUG
     int          num_works_done;
 #endif
@@ -76,26 +72,97 @@ typedef struct {
 } thread_t;
 
 typedef struct tpool tpool_t;
+
+/*
+ * Works of a strand are kept in an intrusive lock-free queue with a stub
+ * node: producers exchange head and link the old head to the new work,
+ * the single runner advances tail. Whoever sets scheduled from 0 to 1
+ * owns the strand and is the only one allowed to pop works from it.
+*/
+typedef struct tpool_strand {
+    tpool_t             *tpool;
+    tpool_work_t        *head;      /* work added last */
+    tpool_work_t        *tail;      /* work to run next */
+    tpool_work_t         stub;
+    int                  scheduled;
+    struct tpool_strand *next;      /* strands of the same pool */
+    struct tpool_strand *deferred_next;
+} tpool_strand_t;
+
+/*
+ * Works of a group wait in its own queue instead of the thread queues.
+ * Just main thread can increase group->in, any worker thread can take
+ * work by increasing group->out.
+*/
+typedef struct {
+    tpool_t      *tpool;
+    int          weight;
+    int          max_running;   /* 0 means no limit */
+    int          running;
+    int          deficit;       /* works the group may still start in its turn */
+    unsigned int in;
+    unsigned int out;
+    tpool_work_t work_queue[WORK_QUEUE_SIZE];
+} tpool_group_t;
+
+#define group_in_val(group)         (__atomic_load_n(&(group)->in, __ATOMIC_ACQUIRE))
+#define group_out_val(group)        (__atomic_load_n(&(group)->out, __ATOMIC_ACQUIRE))
+#define group_queue_len(group)      (group_in_val(group) - group_out_val(group))
+#define group_queue_empty(group)    (group_queue_len(group) == 0)
+#define group_queue_full(group)     (group_queue_len(group) == WORK_QUEUE_SIZE)
+#define group_capped(group)         ((group)->max_running > 0 && \
+        __atomic_load_n(&(group)->running, __ATOMIC_ACQUIRE) >= (group)->max_running)
+
 typedef thread_t* (*schedule_thread_func)(tpool_t *tpool);
 struct tpool {
     int                 num_threads;
     thread_t            threads[MAX_THREAD_NUM];
     schedule_thread_func schedule_thread;
+    tpool_strand_t      *strands;
+    tpool_strand_t      *key_strands[KEY_STRAND_NUM];
+    int                 num_groups;
+    tpool_group_t       *groups[MAX_GROUP_NUM];
+    unsigned int        group_turn;     /* groups[group_turn % num_groups] is served */
+    unsigned int        next_wake;
 };
 
 static pthread_t main_tid;
 static volatile int global_num_thread = 0;
+/* worker thread running the current work */
+static __thread thread_t *current_thread;
+
+static void strand_run(void *arg);
 
 static int tpool_queue_empty(tpool_t *tpool)
 {
+    tpool_strand_t *strand;
     int i;
 
     for (i = 0; i < tpool->num_threads; i++)
-        if (!thread_queue_empty(&tpool->threads[i]))
+        if (!thread_queue_empty(&tpool->threads[i]) ||
+                __atomic_load_n(&tpool->threads[i].deferred_head, __ATOMIC_ACQUIRE))
+            return 0;
+    for (i = 0; i < tpool->num_groups; i++)
+        if (!group_queue_empty(tpool->groups[i]))
+            return 0;
+    /* a strand stays scheduled while its batch runs, even after leaving the ring */
+    for (strand = tpool->strands; strand; strand = strand->next)
+        if (__atomic_load_n(&strand->scheduled, __ATOMIC_ACQUIRE))
             return 0;
     return 1;
 }
 
+/* whether some group has work which may start now */
+static int tpool_group_runnable(tpool_t *tpool)
+{
+    int i, num_groups = __atomic_load_n(&tpool->num_groups, __ATOMIC_ACQUIRE);
+
+    for (i = 0; i < num_groups; i++)
+        if (!group_queue_empty(tpool->groups[i]) && !group_capped(tpool->groups[i]))
+            return 1;
+    return 0;
+}
+
 static thread_t* round_robin_schedule(tpool_t *tpool)
 {
     static int cur_thread_index = -1;
@@ -154,13 +221,99 @@ static tpool_work_t *get_work_concurrently(thread_t *thread)
     return work;
 }
 
+static int get_group_work_concurrently(tpool_group_t *group, tpool_work_t *work)
+{
+    unsigned int tmp;
+
+    do {
+        tmp = group_out_val(group);
+        if (group_in_val(group) == tmp)
+            return 0;
+        /* copy before taking it, the slot may be reused right after */
+        *work = group->work_queue[queue_offset(tmp)];
+    } while (!__sync_bool_compare_and_swap(&group->out, tmp, tmp + 1));
+    return 1;
+}
+
+/*
+ * Pass the turn to the next group, which may start up to weight works in
+ * its turn. Credits left from a turn cut short by max_running are kept,
+ * but never more than one turn's worth.
+*/
+static void group_next_turn(tpool_t *tpool, unsigned int turn, int num_groups)
+{
+    tpool_group_t *group;
+    int deficit, new_deficit;
+
+    if (!__sync_bool_compare_and_swap(&tpool->group_turn, turn, turn + 1))
+        return;
+    group = tpool->groups[(turn + 1) % num_groups];
+    do {
+        deficit = group->deficit;
+        new_deficit = deficit + group->weight;
+        if (new_deficit > group->weight)
+            new_deficit = group->weight;
+    } while (!__sync_bool_compare_and_swap(&group->deficit, deficit, new_deficit));
+}
+
+/*
+ * Deficit round robin across groups shared by all worker threads. Every
+ * work costs one credit, so in each round a busy group starts weight
+ * works. An idle group loses its credits, a group reaching max_running
+ * gives the turn away.
+*/
+static tpool_group_t *get_group_work(tpool_t *tpool, tpool_work_t *work)
+{
+    int i, num_groups = __atomic_load_n(&tpool->num_groups, __ATOMIC_ACQUIRE);
+    unsigned int turn;
+    int deficit, running;
+    tpool_group_t *group;
+
+    if (num_groups == 0)
+        return NULL;
+    for (i = 0; i < 2 * num_groups + 1; i++) {
+        turn = __atomic_load_n(&tpool->group_turn, __ATOMIC_ACQUIRE);
+        group = tpool->groups[turn % num_groups];
+        if (group_queue_empty(group)) {
+            __atomic_store_n(&group->deficit, 0, __ATOMIC_RELEASE);
+            group_next_turn(tpool, turn, num_groups);
+            continue;
+        }
+        deficit = __atomic_load_n(&group->deficit, __ATOMIC_ACQUIRE);
+        if (deficit <= 0) {
+            group_next_turn(tpool, turn, num_groups);
+            continue;
+        }
+        if (!__sync_bool_compare_and_swap(&group->deficit, deficit, deficit - 1))
+            continue;
+        do {
+            running = group->running;
+            if (group->max_running > 0 && running >= group->max_running)
+                break;
+        } while (!__sync_bool_compare_and_swap(&group->running, running, running + 1));
+        if (group->max_running > 0 && running >= group->max_running) {
+            __sync_fetch_and_add(&group->deficit, 1);
+            group_next_turn(tpool, turn, num_groups);
+            continue;
+        }
+        if (get_group_work_concurrently(group, work))
+            return group;
+        __sync_fetch_and_sub(&group->running, 1);
+    }
+    return NULL;
+}
+
 static void *tpool_thread(void *arg)
 {
     thread_t *thread = arg;
     tpool_work_t *work = NULL;
+    tpool_work_t group_work;
+    tpool_group_t *group;
+    tpool_strand_t *strand;
     sigset_t signal_mask, oldmask;
     int rc, sig_caught;
 
+    current_thread = thread;
     /* SIGUSR1 handler has been set in tpool_init */
     __sync_fetch_and_add(&global_num_thread, 1);
     pthread_kill(main_tid, SIGUSR1);
@@ -175,7 +328,10 @@ static void *tpool_thread(void *arg)
             debug(TPOOL_ERROR, "SIG_BLOCK failed");
             pthread_exit(NULL);
         }
-        while (thread_queue_empty(thread) && !thread->shutdown) {
+        __atomic_store_n(&thread->sleeping, 1, __ATOMIC_SEQ_CST);
+        __sync_synchronize();
+        while (thread_queue_empty(thread) && thread->deferred_head == NULL &&
+                !tpool_group_runnable(thread->tpool) && !thread->shutdown) {
             debug(TPOOL_DEBUG, "I'm sleep");
             rc = sigwait (&signal_mask, &sig_caught);
             if (rc != 0) {
@@ -183,6 +339,7 @@ static void *tpool_thread(void *arg)
                 pthread_exit(NULL);
             }
         }
+        __atomic_store_n(&thread->sleeping, 0, __ATOMIC_SEQ_CST);
 
         rc = pthread_sigmask(SIG_SETMASK, &oldmask, NULL);
         if (rc != 0) {
@@ -205,6 +362,21 @@ static void *tpool_thread(void *arg)
             thread->num_works_done++;
 #endif
         }
+        group = get_group_work(thread->tpool, &group_work);
+        if (group) {
+            (*(group_work.routine))(group_work.arg);
+            __sync_fetch_and_sub(&group->running, 1);
+#ifdef DEBUG
+            thread->num_works_done++;
+#endif
+        }
+        strand = thread->deferred_head;
+        if (strand) {
+            __atomic_store_n(&thread->deferred_head, strand->deferred_next, __ATOMIC_RELEASE);
+            if (thread->deferred_head == NULL)
+                thread->deferred_tail = NULL;
+            strand_run(strand);
+        }
         if (thread_queue_empty(thread))
             pthread_kill(main_tid, SIGUSR1);
     }
@@ -213,6 +385,7 @@ static void *tpool_thread(void *arg)
 static void spawn_new_thread(tpool_t *tpool, int index)
 {
     memset(&tpool->threads[index], 0, sizeof(thread_t));
+    tpool->threads[index].tpool = tpool;
     if (pthread_create(&tpool->threads[index].id, NULL, tpool_thread,
                        (void *)(&tpool->threads[index])) != 0) {
         debug(TPOOL_ERROR, "pthread_create failed");
@@ -325,6 +498,22 @@ static int migrate_thread_work(tpool_t *tpool, thread_t *from)
     return 0;
 }
 
+/* strands stay scheduled while deferred, hand them to other threads as they are */
+static int migrate_deferred_strands(tpool_t *tpool, thread_t *from)
+{
+    tpool_strand_t *strand;
+    thread_t *to;
+
+    while ((strand = from->deferred_head) != NULL) {
+        from->deferred_head = strand->deferred_next;
+        to = tpool->schedule_thread(tpool);
+        if (dispatch_work2thread(tpool, to, strand_run, strand) < 0)
+            return -1;
+    }
+    from->deferred_tail = NULL;
+    return 0;
+}
+
 static int isnegtive(int val)
 {
     return val < 0;
@@ -444,7 +633,8 @@ void tpool_dec_threads(void *pool, int num_dec)
     for (i = tpool->num_threads; i < num_threads; i++) {
         pthread_join(tpool->threads[i].id, NULL);
         /* migrate remaining work to other threads */
-        if (migrate_thread_work(tpool, &tpool->threads[i]) < 0)
+        if (migrate_thread_work(tpool, &tpool->threads[i]) < 0 ||
+                migrate_deferred_strands(tpool, &tpool->threads[i]) < 0)
             debug(TPOOL_WARNING, "work lost during migration!!!");
     }
     if (tpool->num_threads == 0 && !tpool_queue_empty(tpool))
@@ -461,6 +651,247 @@ int tpool_add_work(void *pool, void(*routine)(void *), void *arg)
     return dispatch_work2thread(tpool, thread, routine, arg);
 }
 
+static void strand_push(tpool_strand_t *strand, tpool_work_t *work)
+{
+    tpool_work_t *prev;
+
+    work->next = NULL;
+    prev = __atomic_exchange_n(&strand->head, work, __ATOMIC_ACQ_REL);
+    __atomic_store_n(&prev->next, work, __ATOMIC_RELEASE);
+}
+
+#define strand_queue_empty(strand) \
+    (__atomic_load_n(&(strand)->head, __ATOMIC_ACQUIRE) == &(strand)->stub)
+
+/*
+ * Return NULL if the queue is empty or the producer of the next work
+ * has not linked it yet.
+*/
+static tpool_work_t *strand_pop(tpool_strand_t *strand)
+{
+    tpool_work_t *tail = strand->tail;
+    tpool_work_t *next = __atomic_load_n(&tail->next, __ATOMIC_ACQUIRE);
+
+    if (tail == &strand->stub) {
+        if (next == NULL)
+            return NULL;
+        strand->tail = next;
+        tail = next;
+        next = __atomic_load_n(&next->next, __ATOMIC_ACQUIRE);
+    }
+    if (next) {
+        strand->tail = next;
+        return tail;
+    }
+    if (tail != __atomic_load_n(&strand->head, __ATOMIC_ACQUIRE))
+        return NULL;
+    /* tail is the last work, put stub behind it so that it can be popped */
+    strand_push(strand, &strand->stub);
+    next = __atomic_load_n(&tail->next, __ATOMIC_ACQUIRE);
+    if (next) {
+        strand->tail = next;
+        return tail;
+    }
+    return NULL;
+}
+
+/* run the strand again after the next work of the thread, still scheduled */
+static void strand_defer(thread_t *thread, tpool_strand_t *strand)
+{
+    strand->deferred_next = NULL;
+    if (thread->deferred_tail)
+        thread->deferred_tail->deferred_next = strand;
+    else
+        __atomic_store_n(&thread->deferred_head, strand, __ATOMIC_RELEASE);
+    thread->deferred_tail = strand;
+}
+
+/*
+ * Run up to STRAND_BATCH works of a strand in one go on the current worker
+ * thread, which keeps the state they share in its cache. A strand with
+ * more works is deferred, so that works queued behind it are not held up
+ * by a busy strand. Otherwise the strand is only given up when its queue
+ * is empty, rechecking after that to catch works added in between.
+*/
+static void strand_run(void *arg)
+{
+    tpool_strand_t *strand = arg;
+    tpool_work_t *work;
+    int num_done = 0;
+
+    while (1) {
+        while (!strand_queue_empty(strand)) {
+            if (num_done == STRAND_BATCH) {
+                strand_defer(current_thread, strand);
+                return;
+            }
+            work = strand_pop(strand);
+            if (work == NULL)
+                continue;
+            (*(work->routine))(work->arg);
+            free(work);
+            num_done++;
+        }
+        __atomic_store_n(&strand->scheduled, 0, __ATOMIC_SEQ_CST);
+        if (strand_queue_empty(strand) ||
+                !__sync_bool_compare_and_swap(&strand->scheduled, 0, 1))
+            break;
+    }
+}
+
+static tpool_strand_t *strand_new(tpool_t *tpool)
+{
+    tpool_strand_t *strand;
+
+    strand = malloc(sizeof(*strand));
+    if (strand == NULL) {
+        debug(TPOOL_ERROR, "malloc failed");
+        return NULL;
+    }
+    memset(strand, 0, sizeof(*strand));
+    strand->tpool = tpool;
+    strand->head = &strand->stub;
+    strand->tail = &strand->stub;
+    strand->next = tpool->strands;
+    tpool->strands = strand;
+    return strand;
+}
+
+/* Works can not run any more, drop what is left */
+static void strand_free_all(tpool_t *tpool)
+{
+    tpool_strand_t *strand, *next;
+    tpool_work_t *work;
+
+    for (strand = tpool->strands; strand; strand = next) {
+        next = strand->next;
+        while ((work = strand_pop(strand)) != NULL)
+            free(work);
+        free(strand);
+    }
+    tpool->strands = NULL;
+}
+
+void *tpool_strand_create(void *pool)
+{
+    tpool_t *tpool = pool;
+
+    assert(tpool);
+    return strand_new(tpool);
+}
+
+int tpool_strand_add_work(void *strand_, void(*routine)(void *), void *arg)
+{
+    tpool_strand_t *strand = strand_;
+    tpool_work_t *work;
+
+    assert(strand);
+    work = malloc(sizeof(*work));
+    if (work == NULL) {
+        debug(TPOOL_ERROR, "malloc failed");
+        return -1;
+    }
+    work->routine = routine;
+    work->arg = arg;
+    strand_push(strand, work);
+    if (!__sync_bool_compare_and_swap(&strand->scheduled, 0, 1))
+        return 0;
+    if (tpool_add_work(strand->tpool, strand_run, strand) < 0) {
+        /*
+         * Works added while the last runner was giving the strand up may be
+         * queued before ours. Only take ours back when it is alone, otherwise
+         * everything stays queued until the next add schedules the strand.
+        */
+        if (strand->tail == &strand->stub && strand->stub.next == work &&
+                __atomic_load_n(&strand->head, __ATOMIC_ACQUIRE) == work) {
+            work = strand_pop(strand);
+            free(work);
+            __atomic_store_n(&strand->scheduled, 0, __ATOMIC_SEQ_CST);
+            return -1;
+        }
+        __atomic_store_n(&strand->scheduled, 0, __ATOMIC_SEQ_CST);
+    }
+    return 0;
+}
+
+int tpool_add_work_keyed(void *pool, unsigned long key, void(*routine)(void *), void *arg)
+{
+    tpool_t *tpool = pool;
+    unsigned int index;
+
+    assert(tpool);
+    /* fibonacci hashing, different keys may share a strand */
+    index = (unsigned int)((key * 0x9e3779b97f4a7c15ULL) >> (64 - KEY_STRAND_POWER));
+    if (tpool->key_strands[index] == NULL) {
+        tpool->key_strands[index] = strand_new(tpool);
+        if (tpool->key_strands[index] == NULL)
+            return -1;
+    }
+    return tpool_strand_add_work(tpool->key_strands[index], routine, arg);
+}
+
+void *tpool_group_create(void *pool, int weight, int max_running)
+{
+    tpool_t *tpool = pool;
+    tpool_group_t *group;
+
+    assert(tpool && weight > 0 && max_running >= 0);
+    if (tpool->num_groups == MAX_GROUP_NUM) {
+        debug(TPOOL_ERROR, "too many groups!!!");
+        return NULL;
+    }
+    group = malloc(sizeof(*group));
+    if (group == NULL) {
+        debug(TPOOL_ERROR, "malloc failed");
+        return NULL;
+    }
+    memset(group, 0, sizeof(*group));
+    group->tpool = tpool;
+    group->weight = weight;
+    group->max_running = max_running;
+    tpool->groups[tpool->num_groups] = group;
+    __atomic_store_n(&tpool->num_groups, tpool->num_groups + 1, __ATOMIC_RELEASE);
+    return group;
+}
+
+/*
+ * Wake up one sleeping worker thread, busy ones look at the groups again
+ * after their current work.
+*/
+static void group_wake_thread(tpool_t *tpool)
+{
+    int i;
+    thread_t *thread;
+
+    for (i = 0; i < tpool->num_threads; i++) {
+        thread = &tpool->threads[(tpool->next_wake + i) % tpool->num_threads];
+        if (__atomic_load_n(&thread->sleeping, __ATOMIC_SEQ_CST)) {
+            tpool->next_wake += i + 1;
+            pthread_kill(thread->id, SIGUSR1);
+            return;
+        }
+    }
+}
+
+int tpool_group_add_work(void *group_, void(*routine)(void *), void *arg)
+{
+    tpool_group_t *group = group_;
+    tpool_work_t *work;
+
+    assert(group);
+    if (group_queue_full(group)) {
+        debug(TPOOL_WARNING, "queue of group is full!!!");
+        return -1;
+    }
+    work = &group->work_queue[queue_offset(group->in)];
+    work->routine = routine;
+    work->arg = arg;
+    work->next = NULL;
+    /* pairs with thread->sleeping, either the worker sees the work or we see it sleeping */
+    __atomic_store_n(&group->in, group->in + 1, __ATOMIC_SEQ_CST);
+    group_wake_thread(group->tpool);
+    return 0;
+}
 
 void tpool_destroy(void *pool, int finish)
 {
@@ -507,5 +938,8 @@ void tpool_destroy(void *pool, int finish)
     for (i = 0; i < tpool->num_threads; i++) {
         pthread_join(tpool->threads[i].id, NULL);
     }
+    strand_free_all(tpool);
+    for (i = 0; i < tpool->num_groups; i++)
+        free(tpool->groups[i]);
     free(tpool);
 }
@@ -1,6 +1,10 @@
 #ifndef __TPOOL_H__
 #define __TPOOL_H__
 
+#ifdef __cplusplus
+extern "C" {
+#endif
+
 enum schedule_type {
     ROUND_ROBIN,
     LEAST_LOAD
@@ -22,4 +26,65 @@ void tpool_destroy(void *pool, int finish);
 /* set thread schedule algorithm, default is round-robin */
 void set_thread_schedule_algorithm(void *pool, enum schedule_type type);
 
+/*
+ * Works added to one strand run in the order they were added and never
+ * concurrently, so they need no lock for the state they share.
+ * Strands belong to the pool and are freed by tpool_destroy.
+*/
+void *tpool_strand_create(void *pool);
+
+/*
+ * Return -1 if the work could not be added. When the queue of the thread
+ * selected is full but other works are waiting in the strand, the work is
+ * kept and 0 returned: all of them start with the next add to the strand.
+*/
+int tpool_strand_add_work(void *strand, void(*routine)(void *), void *arg);
+
+/* add work to the strand picked by key, works with the same key never overlap */
+int tpool_add_work_keyed(void *pool, unsigned long key, void(*routine)(void *), void *arg);
+
+/*
+ * Works of a group wait in a queue of their own and worker threads take
+ * them by deficit round robin across groups, so a busy group gets a share
+ * of the threads proportional to its weight and can not starve the others.
+@weight:       works the group may start in each round, > 0
+@max_running:  most works of the group running at a time, 0 for no limit
+*/
+void *tpool_group_create(void *pool, int weight, int max_running);
+
+int tpool_group_add_work(void *group, void(*routine)(void *), void *arg);
+
+/*
+ * Shared memory mode: worker threads of one process serve works added by
+ * any process on the host. A work is a function id, an index into the
+ * funcs given to tpool_shm_create, and a payload copied into the queue.
+*/
+#define TPOOL_SHM_PAYLOAD_SIZE 112
+
+typedef void (*tpool_shm_func)(void *payload, unsigned int len);
+
+/* @name: shared memory object name as for shm_open, e.g. "/lftpool" */
+void *tpool_shm_create(const char *name, int num_worker_threads,
+                       const tpool_shm_func *funcs, int num_funcs);
+/*
+@finish:  1, complete remaining works before return
+        0, drop remaining works and return directly
+*/
+void tpool_shm_destroy(void *pool, int finish);
+
+/*
+ * A client handle records the one slot it is filling, so that the slot can
+ * be dropped if the process dies. Only the thread which attached may add
+ * works with it, other threads attach handles of their own.
+*/
+void *tpool_shm_attach(const char *name);
+
+int tpool_shm_add_work(void *client, int func_id, const void *payload, unsigned int len);
+
+void tpool_shm_detach(void *client);
+
+#ifdef __cplusplus
+}
+#endif
+
 #endif
@@ -0,0 +1,181 @@
+/***************************************************************************
+** Name         : tpool.hpp
+** Description  : Header-only C++ front end of the thread pool.
+**
+** This file may be redistributed under the terms
+** of the GNU Public License.
+***************************************************************************/
+
+#ifndef __TPOOL_HPP__
+#define __TPOOL_HPP__
+
+#include <cstring>
+#include <future>
+#include <memory>
+#include <stdexcept>
+#include <tuple>
+#include <type_traits>
+#include <utility>
+#include "tpool.h"
+
+namespace lftpool {
+
+/*
+ * arg is the inline buffer: callables which fit into it and are trivially
+ * copyable are stored by value, others are moved into one heap block
+ * which the worker frees after running it. The next word of a slot is
+ * not used, because works moved between threads by tpool_inc_threads and
+ * tpool_dec_threads are added again with routine and arg only.
+*/
+constexpr std::size_t inline_size = sizeof(void *);
+
+template <class Fn>
+constexpr bool fits_inline = sizeof(Fn) <= inline_size &&
+                             alignof(Fn) <= alignof(void *) &&
+                             std::is_trivially_copyable<Fn>::value;
+
+namespace detail {
+
+template <class Fn>
+void run_inline(void *arg)
+{
+    alignas(Fn) unsigned char buf[sizeof(Fn)];
+
+    std::memcpy(buf, &arg, sizeof(Fn));
+    try {
+        (*reinterpret_cast<Fn *>(buf))();
+    } catch (...) {
+        /* nobody to report to, see pool::post */
+    }
+}
+
+template <class Fn>
+void run_heap(void *arg)
+{
+    std::unique_ptr<Fn> fn(static_cast<Fn *>(arg));
+
+    try {
+        (*fn)();
+    } catch (...) {
+        /* nobody to report to, see pool::post */
+    }
+}
+
+template <class R, class Fn>
+struct task {
+    Fn              fn;
+    std::promise<R> promise;
+
+    explicit task(Fn &&f) : fn(std::move(f)) {}
+
+    void operator()()
+    {
+        try {
+            if constexpr (std::is_void<R>::value) {
+                fn();
+                promise.set_value();
+            } else {
+                promise.set_value(fn());
+            }
+        } catch (...) {
+            promise.set_exception(std::current_exception());
+        }
+    }
+};
+
+} /* namespace detail */
+
+/*
+ * Owns a pool created by tpool_init. Like the C API, the object must be
+ * created, used and destroyed from one thread: works are only added by
+ * the thread owning the pool.
+*/
+class pool {
+public:
+    explicit pool(int num_threads, enum schedule_type type = ROUND_ROBIN)
+        : tpool_(tpool_init(num_threads))
+    {
+        if (tpool_ == nullptr)
+            throw std::runtime_error("tpool_init failed");
+        set_thread_schedule_algorithm(tpool_, type);
+    }
+
+    /* complete remaining works before return */
+    ~pool()
+    {
+        tpool_destroy(tpool_, 1);
+    }
+
+    pool(const pool &) = delete;
+    pool &operator=(const pool &) = delete;
+
+    void *native_handle() const
+    {
+        return tpool_;
+    }
+
+    int inc_threads(int num_inc)
+    {
+        return tpool_inc_threads(tpool_, num_inc);
+    }
+
+    void dec_threads(int num_dec)
+    {
+        tpool_dec_threads(tpool_, num_dec);
+    }
+
+    /*
+     * run f without any result, nothing is allocated when f fits inline.
+     * An exception thrown by f is dropped, use submit to get it.
+    */
+    template <class F>
+    void post(F &&f)
+    {
+        using Fn = std::decay_t<F>;
+
+        if constexpr (fits_inline<Fn>) {
+            void *arg = nullptr;
+            Fn fn(std::forward<F>(f));
+
+            std::memcpy(&arg, static_cast<const void *>(&fn), sizeof(Fn));
+            add_work(&detail::run_inline<Fn>, arg);
+        } else {
+            std::unique_ptr<Fn> fn(new Fn(std::forward<F>(f)));
+
+            add_work(&detail::run_heap<Fn>, fn.get());
+            fn.release();
+        }
+    }
+
+    /* run f(args...) and return its result or exception through a future */
+    template <class F, class... Args>
+    auto submit(F &&f, Args &&...args)
+        -> std::future<std::invoke_result_t<std::decay_t<F>, std::decay_t<Args>...>>
+    {
+        using R = std::invoke_result_t<std::decay_t<F>, std::decay_t<Args>...>;
+        auto call = [fn = std::forward<F>(f),
+                     tup = std::make_tuple(std::forward<Args>(args)...)]() mutable -> R {
+            return std::apply(std::move(fn), std::move(tup));
+        };
+        using Task = detail::task<R, decltype(call)>;
+        std::unique_ptr<Task> task(new Task(std::move(call)));
+        std::future<R> future = task->promise.get_future();
+
+        add_work(&detail::run_heap<Task>, task.get());
+        task.release();
+        return future;
+    }
+
+private:
+    void add_work(void (*routine)(void *), void *arg)
+    {
+        if (tpool_add_work(tpool_, routine, arg) < 0)
+            throw std::runtime_error("queue of thread selected is full");
+    }
+
+    void *tpool_;
+};
+
+} /* namespace lftpool */
+
+#endif
@@ -0,0 +1,25 @@
+#ifndef __TPOOL_DEBUG_H__
+#define __TPOOL_DEBUG_H__
+
+#include <stdio.h>
+#include <pthread.h>
+
+enum {
+    TPOOL_ERROR,
+    TPOOL_WARNING,
+    TPOOL_INFO,
+    TPOOL_DEBUG
+};
+
+#define debug(level, ...) do { \
+    if (level < TPOOL_DEBUG) {\
+        flockfile(stdout); \
+        printf("###%p.%s: ", (void *)pthread_self(), __func__); \
+        printf(__VA_ARGS__); \
+        putchar('\n'); \
+        fflush(stdout); \
+        funlockfile(stdout);\
+    }\
+} while (0)
+
+#endif
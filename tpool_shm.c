@@ -0,0 +1,487 @@
+/***************************************************************************
+** Name         : tpool_shm.c
+** Description  : Thread pool serving works added by other processes
+**                through a named shared memory segment.
+**
+** This file may be redistributed under the terms
+** of the GNU Public License.
+***************************************************************************/
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <limits.h>
+#include <string.h>
+#include <signal.h>
+#include <time.h>
+#include <assert.h>
+#include "tpool.h"
+#include "tpool_debug.h"
+
+#define SHM_QUEUE_POWER 16
+#define SHM_QUEUE_SIZE  (1 << SHM_QUEUE_POWER)
+#define SHM_QUEUE_MASK  (SHM_QUEUE_SIZE - 1)
+#define shm_queue_offset(val) ((val) & SHM_QUEUE_MASK)
+
+#define SHM_MAX_CLIENTS 64
+#define SHM_MAX_THREAD_NUM 512
+#define SHM_MAGIC 0x4c465450
+/* pid of a client entry being taken, start_time is not set yet */
+#define SHM_CLIENT_ATTACHING (-1)
+/* func_id of a work whose client died before filling it */
+#define SHM_FUNC_NONE (-1)
+/* worker threads sleeping longer look for dead clients */
+#define SHM_WAIT_NS 100000000L
+
+/*
+ * Everything in the segment is position independent: it is mapped at
+ * different addresses in every process.
+ *
+ * The queue is a bounded array where each slot carries a sequence number,
+ * so producers and consumers never lock: position pos is free for a
+ * producer when seq == pos, filled when seq == pos + 1 and free again for
+ * position pos + SHM_QUEUE_SIZE once consumed.
+*/
+typedef struct {
+    unsigned int seq;
+    int          func_id;
+    unsigned int len;
+    char         payload[TPOOL_SHM_PAYLOAD_SIZE] __attribute__((aligned(8)));
+} shm_work_t;
+
+/*
+ * A client announces the position it is claiming before taking it, so a
+ * client dying between claiming and filling a slot can be found. The
+ * start time of the process tells a reused pid from the client.
+*/
+typedef struct {
+    pid_t              pid;         /* 0 if the entry is free */
+    int                claiming;
+    unsigned int       claim;
+    unsigned long long start_time;  /* 0 if unknown */
+} shm_client_t;
+
+typedef struct {
+    unsigned int magic;
+    unsigned int size;
+    int          shutdown;
+    int          recovering;
+    unsigned int wake_seq;      /* futex word of sleeping worker threads */
+    int          num_sleeping;
+    unsigned int in __attribute__((aligned(64)));
+    unsigned int out __attribute__((aligned(64)));
+    shm_client_t clients[SHM_MAX_CLIENTS] __attribute__((aligned(64)));
+    shm_work_t   work_queue[SHM_QUEUE_SIZE];
+} shm_queue_t;
+
+typedef struct {
+    shm_queue_t    *queue;
+    char           name[NAME_MAX];
+    int            num_threads;
+    pthread_t      threads[SHM_MAX_THREAD_NUM];
+    int            num_funcs;
+    tpool_shm_func funcs[];
+} tpool_shm_t;
+
+typedef struct {
+    shm_queue_t  *queue;
+    shm_client_t *client;
+    pthread_t    owner;     /* the only thread adding works with this handle */
+} tpool_shm_client_t;
+
+static int futex(unsigned int *uaddr, int op, unsigned int val, const struct timespec *timeout)
+{
+    /* no FUTEX_PRIVATE_FLAG, waiters and wakers live in different processes */
+    return syscall(SYS_futex, uaddr, op, val, timeout, NULL, 0);
+}
+
+/* field 22 of /proc/<pid>/stat in clock ticks since boot, 0 if unknown */
+static unsigned long long process_start_time(pid_t pid)
+{
+    char path[64], buf[1024], *p;
+    unsigned long long start_time = 0;
+    FILE *fp;
+    size_t len;
+
+    snprintf(path, sizeof(path), "/proc/%d/stat", (int)pid);
+    fp = fopen(path, "r");
+    if (fp == NULL)
+        return 0;
+    len = fread(buf, 1, sizeof(buf) - 1, fp);
+    fclose(fp);
+    buf[len] = '\0';
+    /* the command name in parentheses may contain spaces */
+    p = strrchr(buf, ')');
+    if (p == NULL || sscanf(p + 2, "%*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %*u %*u "
+                            "%*d %*d %*d %*d %*d %*d %llu", &start_time) != 1)
+        return 0;
+    return start_time;
+}
+
+static int client_alive(shm_client_t *client, pid_t pid)
+{
+    unsigned long long start_time;
+
+    if (kill(pid, 0) < 0 && errno != EPERM)
+        return 0;
+    start_time = process_start_time(pid);
+    if (start_time == 0 || client->start_time == 0)
+        return 1;
+    return start_time == client->start_time;
+}
+
+static shm_work_t *queue_slot(shm_queue_t *queue, unsigned int pos)
+{
+    return &queue->work_queue[shm_queue_offset(pos)];
+}
+
+static unsigned int slot_seq(shm_work_t *work)
+{
+    return __atomic_load_n(&work->seq, __ATOMIC_ACQUIRE);
+}
+
+/* whether the next work to take has been filled */
+static int shm_queue_ready(shm_queue_t *queue)
+{
+    unsigned int out = __atomic_load_n(&queue->out, __ATOMIC_ACQUIRE);
+
+    return slot_seq(queue_slot(queue, out)) == out + 1;
+}
+
+static int get_shm_work(shm_queue_t *queue, shm_work_t *work)
+{
+    unsigned int pos = __atomic_load_n(&queue->out, __ATOMIC_ACQUIRE);
+    shm_work_t *slot;
+    int dif;
+
+    while (1) {
+        slot = queue_slot(queue, pos);
+        dif = (int)(slot_seq(slot) - (pos + 1));
+        if (dif == 0) {
+            if (__sync_bool_compare_and_swap(&queue->out, pos, pos + 1))
+                break;
+            pos = __atomic_load_n(&queue->out, __ATOMIC_ACQUIRE);
+        } else if (dif < 0) {
+            return 0;
+        } else {
+            pos = __atomic_load_n(&queue->out, __ATOMIC_ACQUIRE);
+        }
+    }
+    memcpy(work, slot, sizeof(*work));
+    __atomic_store_n(&slot->seq, pos + SHM_QUEUE_SIZE, __ATOMIC_RELEASE);
+    return 1;
+}
+
+/*
+ * The next work was claimed but is not filled. If every client which may
+ * have claimed it is dead, fill it with SHM_FUNC_NONE so that the queue
+ * moves on. Entries of dead clients are freed once they claim nothing
+ * that is still waiting in the queue. Only one worker thread recovers at
+ * a time.
+*/
+static void shm_recover(shm_queue_t *queue)
+{
+    unsigned int out, in;
+    shm_work_t *slot;
+    shm_client_t *client;
+    int i, num_alive = 0, num_dead = 0;
+    pid_t pid;
+
+    if (!__sync_bool_compare_and_swap(&queue->recovering, 0, 1))
+        return;
+    out = __atomic_load_n(&queue->out, __ATOMIC_ACQUIRE);
+    in = __atomic_load_n(&queue->in, __ATOMIC_ACQUIRE);
+    slot = queue_slot(queue, out);
+    for (i = 0; i < SHM_MAX_CLIENTS; i++) {
+        client = &queue->clients[i];
+        pid = __atomic_load_n(&client->pid, __ATOMIC_ACQUIRE);
+        if (pid == 0 || pid == SHM_CLIENT_ATTACHING)
+            continue;
+        if (client_alive(client, pid)) {
+            if (__atomic_load_n(&client->claiming, __ATOMIC_ACQUIRE) && client->claim == out)
+                num_alive++;
+            continue;
+        }
+        if (client->claiming && client->claim == out && in != out)
+            num_dead++;
+        /* claims behind out were taken by others or filled already, ahead of in never taken */
+        if (client->claiming && ((int)(client->claim - out) < 0 || (int)(in - client->claim) <= 0))
+            client->claiming = 0;
+        if (!client->claiming) {
+            debug(TPOOL_WARNING, "client %d died", pid);
+            __sync_bool_compare_and_swap(&client->pid, pid, 0);
+        }
+    }
+    if (num_dead > 0 && num_alive == 0 && slot_seq(slot) == out) {
+        debug(TPOOL_WARNING, "drop work %u of dead client", out);
+        slot->func_id = SHM_FUNC_NONE;
+        slot->len = 0;
+        __atomic_store_n(&slot->seq, out + 1, __ATOMIC_RELEASE);
+        for (i = 0; i < SHM_MAX_CLIENTS; i++) {
+            client = &queue->clients[i];
+            if (client->pid && client->claiming && client->claim == out)
+                client->claiming = 0;
+        }
+    }
+    __atomic_store_n(&queue->recovering, 0, __ATOMIC_RELEASE);
+}
+
+static void *tpool_shm_thread(void *arg)
+{
+    tpool_shm_t *tpool = arg;
+    shm_queue_t *queue = tpool->queue;
+    struct timespec timeout = {0, SHM_WAIT_NS};
+    shm_work_t work;
+    unsigned int seq;
+
+    while (!__atomic_load_n(&queue->shutdown, __ATOMIC_ACQUIRE)) {
+        if (get_shm_work(queue, &work)) {
+            if (work.func_id >= 0 && work.func_id < tpool->num_funcs)
+                (*(tpool->funcs[work.func_id]))(work.payload, work.len);
+            else if (work.func_id != SHM_FUNC_NONE)
+                debug(TPOOL_WARNING, "unknown function id %d", work.func_id);
+            continue;
+        }
+        seq = __atomic_load_n(&queue->wake_seq, __ATOMIC_ACQUIRE);
+        __sync_fetch_and_add(&queue->num_sleeping, 1);
+        /* either a client adding work sees us sleeping or we see its work */
+        if (!shm_queue_ready(queue) && !__atomic_load_n(&queue->shutdown, __ATOMIC_SEQ_CST)) {
+            debug(TPOOL_DEBUG, "I'm sleep");
+            futex(&queue->wake_seq, FUTEX_WAIT, seq, &timeout);
+        }
+        __sync_fetch_and_sub(&queue->num_sleeping, 1);
+        if (!shm_queue_ready(queue) &&
+                __atomic_load_n(&queue->in, __ATOMIC_ACQUIRE) !=
+                __atomic_load_n(&queue->out, __ATOMIC_ACQUIRE))
+            shm_recover(queue);
+    }
+    debug(TPOOL_DEBUG, "exit");
+    return NULL;
+}
+
+static void wake_threads(shm_queue_t *queue, int num)
+{
+    __sync_fetch_and_add(&queue->wake_seq, 1);
+    futex(&queue->wake_seq, FUTEX_WAKE, num, NULL);
+}
+
+void *tpool_shm_create(const char *name, int num_threads,
+                       const tpool_shm_func *funcs, int num_funcs)
+{
+    tpool_shm_t *tpool;
+    shm_queue_t *queue;
+    int fd, i;
+
+    assert(name && funcs && num_funcs > 0);
+    if (num_threads <= 0) {
+        return NULL;
+    } else if (num_threads > SHM_MAX_THREAD_NUM) {
+        debug(TPOOL_ERROR, "too many threads!!!");
+        return NULL;
+    } else if (strlen(name) >= NAME_MAX) {
+        debug(TPOOL_ERROR, "name too long");
+        return NULL;
+    }
+    tpool = malloc(sizeof(*tpool) + num_funcs * sizeof(funcs[0]));
+    if (tpool == NULL) {
+        debug(TPOOL_ERROR, "malloc failed");
+        return NULL;
+    }
+    memset(tpool, 0, sizeof(*tpool));
+    strcpy(tpool->name, name);
+    tpool->num_funcs = num_funcs;
+    memcpy(tpool->funcs, funcs, num_funcs * sizeof(funcs[0]));
+
+    /* a segment left by a crashed pool must be removed by hand */
+    fd = shm_open(name, O_CREAT | O_EXCL | O_RDWR, 0600);
+    if (fd < 0) {
+        debug(TPOOL_ERROR, "shm_open failed: %s", strerror(errno));
+        free(tpool);
+        return NULL;
+    }
+    if (ftruncate(fd, sizeof(*queue)) < 0) {
+        debug(TPOOL_ERROR, "ftruncate failed: %s", strerror(errno));
+        goto err_unlink;
+    }
+    queue = mmap(NULL, sizeof(*queue), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (queue == MAP_FAILED) {
+        debug(TPOOL_ERROR, "mmap failed: %s", strerror(errno));
+        goto err_unlink;
+    }
+    close(fd);
+    /* the segment is zero filled by ftruncate */
+    for (i = 0; i < SHM_QUEUE_SIZE; i++)
+        queue->work_queue[i].seq = i;
+    queue->size = sizeof(*queue);
+    __atomic_store_n(&queue->magic, SHM_MAGIC, __ATOMIC_RELEASE);
+    tpool->queue = queue;
+
+    for (i = 0; i < num_threads; i++) {
+        if (pthread_create(&tpool->threads[i], NULL, tpool_shm_thread, tpool) != 0) {
+            debug(TPOOL_ERROR, "pthread_create failed");
+            exit(0);
+        }
+    }
+    tpool->num_threads = num_threads;
+    return tpool;
+
+err_unlink:
+    close(fd);
+    shm_unlink(name);
+    free(tpool);
+    return NULL;
+}
+
+void tpool_shm_destroy(void *pool, int finish)
+{
+    tpool_shm_t *tpool = pool;
+    shm_queue_t *queue;
+    int i;
+
+    assert(tpool);
+    queue = tpool->queue;
+    /* new clients can not attach any more, attached ones still add works */
+    shm_unlink(tpool->name);
+    if (finish == 1) {
+        debug(TPOOL_DEBUG, "wait all work done");
+        while (__atomic_load_n(&queue->in, __ATOMIC_ACQUIRE) !=
+                __atomic_load_n(&queue->out, __ATOMIC_ACQUIRE))
+            usleep(1000);
+    }
+    __atomic_store_n(&queue->shutdown, 1, __ATOMIC_SEQ_CST);
+    wake_threads(queue, INT_MAX);
+    debug(TPOOL_DEBUG, "wait worker thread exit");
+    for (i = 0; i < tpool->num_threads; i++)
+        pthread_join(tpool->threads[i], NULL);
+    munmap(queue, sizeof(*queue));
+    free(tpool);
+}
+
+void *tpool_shm_attach(const char *name)
+{
+    tpool_shm_client_t *client;
+    shm_queue_t *queue;
+    shm_client_t *entry;
+    pid_t pid, self = getpid();
+    int fd, i;
+
+    assert(name);
+    fd = shm_open(name, O_RDWR, 0);
+    if (fd < 0) {
+        debug(TPOOL_ERROR, "shm_open failed: %s", strerror(errno));
+        return NULL;
+    }
+    queue = mmap(NULL, sizeof(*queue), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (queue == MAP_FAILED) {
+        debug(TPOOL_ERROR, "mmap failed: %s", strerror(errno));
+        return NULL;
+    }
+    if (__atomic_load_n(&queue->magic, __ATOMIC_ACQUIRE) != SHM_MAGIC ||
+            queue->size != sizeof(*queue)) {
+        debug(TPOOL_ERROR, "%s is not a thread pool", name);
+        goto err_unmap;
+    }
+    client = malloc(sizeof(*client));
+    if (client == NULL) {
+        debug(TPOOL_ERROR, "malloc failed");
+        goto err_unmap;
+    }
+    client->queue = queue;
+    client->client = NULL;
+    client->owner = pthread_self();
+    for (i = 0; i < SHM_MAX_CLIENTS && client->client == NULL; i++) {
+        entry = &queue->clients[i];
+        pid = __atomic_load_n(&entry->pid, __ATOMIC_ACQUIRE);
+        /* entries of dead clients with nothing claimed can be taken over */
+        if (pid == SHM_CLIENT_ATTACHING ||
+                (pid != 0 && (client_alive(entry, pid) || entry->claiming)))
+            continue;
+        /* recovery skips the entry until its start time matches its pid */
+        if (__sync_bool_compare_and_swap(&entry->pid, pid, SHM_CLIENT_ATTACHING)) {
+            entry->claiming = 0;
+            entry->start_time = process_start_time(self);
+            __atomic_store_n(&entry->pid, self, __ATOMIC_RELEASE);
+            client->client = entry;
+        }
+    }
+    if (client->client == NULL) {
+        debug(TPOOL_ERROR, "too many clients!!!");
+        free(client);
+        goto err_unmap;
+    }
+    return client;
+
+err_unmap:
+    munmap(queue, sizeof(*queue));
+    return NULL;
+}
+
+int tpool_shm_add_work(void *client_, int func_id, const void *payload, unsigned int len)
+{
+    tpool_shm_client_t *client = client_;
+    shm_queue_t *queue;
+    shm_client_t *entry;
+    shm_work_t *slot;
+    unsigned int pos;
+    int dif;
+
+    assert(client && func_id >= 0 && pthread_equal(client->owner, pthread_self()));
+    queue = client->queue;
+    entry = client->client;
+    if (len > TPOOL_SHM_PAYLOAD_SIZE) {
+        debug(TPOOL_ERROR, "payload too large");
+        return -1;
+    }
+    if (__atomic_load_n(&queue->shutdown, __ATOMIC_ACQUIRE)) {
+        debug(TPOOL_WARNING, "thread pool is shut down");
+        return -1;
+    }
+    pos = __atomic_load_n(&queue->in, __ATOMIC_ACQUIRE);
+    while (1) {
+        slot = queue_slot(queue, pos);
+        dif = (int)(slot_seq(slot) - pos);
+        if (dif == 0) {
+            entry->claim = pos;
+            __atomic_store_n(&entry->claiming, 1, __ATOMIC_SEQ_CST);
+            if (__sync_bool_compare_and_swap(&queue->in, pos, pos + 1))
+                break;
+            pos = __atomic_load_n(&queue->in, __ATOMIC_ACQUIRE);
+        } else if (dif < 0) {
+            __atomic_store_n(&entry->claiming, 0, __ATOMIC_RELEASE);
+            debug(TPOOL_WARNING, "queue of thread pool is full!!!");
+            return -1;
+        } else {
+            pos = __atomic_load_n(&queue->in, __ATOMIC_ACQUIRE);
+        }
+    }
+    slot->func_id = func_id;
+    slot->len = len;
+    memcpy(slot->payload, payload, len);
+    __atomic_store_n(&slot->seq, pos + 1, __ATOMIC_RELEASE);
+    __atomic_store_n(&entry->claiming, 0, __ATOMIC_SEQ_CST);
+    /* pairs with num_sleeping of worker threads */
+    if (__atomic_load_n(&queue->num_sleeping, __ATOMIC_SEQ_CST) > 0) {
+        debug(TPOOL_DEBUG, "signal has task");
+        wake_threads(queue, 1);
+    }
+    return 0;
+}
+
+void tpool_shm_detach(void *client_)
+{
+    tpool_shm_client_t *client = client_;
+
+    assert(client);
+    __atomic_store_n(&client->client->claiming, 0, __ATOMIC_RELEASE);
+    __atomic_store_n(&client->client->pid, 0, __ATOMIC_RELEASE);
+    munmap(client->queue, sizeof(*client->queue));
+    free(client);
+}